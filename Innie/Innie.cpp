@@ -8,6 +8,13 @@
 #include <IOKit/IOLib.h>
 #include <IOKit/IORegistryEntry.h>
 #include <IOKit/IODeviceTreeSupport.h>
+#include <IOKit/IOLocks.h>
+#include <IOKit/IONVRAM.h>
+#include <IOKit/IOUserClient.h>
+#include <kern/clock.h>
+#include <kern/thread.h>
+#include <libkern/OSAtomic.h>
+#include <pexpert/pexpert.h>
 
 #include "Innie.hpp"
 
@@ -15,6 +22,28 @@
 
 OSDefineMetaClassAndStructors(Innie, IOService)
 
+static const char *modeNames[] = {
+    "off",
+    "sync",
+    "async",
+    "fastpath",
+    "dryrun",
+};
+
+Innie::Configuration Innie::config {};
+
+static const char *phaseNames[] = {
+    "Discovery",
+    "Walk",
+    "Repair",
+};
+
+static const char *passNames[] = {
+    "Boot",
+    "LateDomain",
+    "Benchmark",
+};
+
 bool Innie::init(OSDictionary *dict) {
     if (!super::init())
         return false;
@@ -23,6 +52,47 @@ bool Innie::init(OSDictionary *dict) {
 }
 
 void Innie::free(void) {
+    freeWalkPool();
+    OSSafeReleaseNULL(processedEntries);
+    OSSafeReleaseNULL(pendingVolumes);
+    OSSafeReleaseNULL(terminatedDevices);
+    OSSafeReleaseNULL(plan);
+    OSSafeReleaseNULL(plannedEntries);
+    OSSafeReleaseNULL(domainStats);
+    OSSafeReleaseNULL(internal);
+    OSSafeReleaseNULL(internalIcon);
+    for (auto &matching : repairMatching)
+        OSSafeReleaseNULL(matching);
+    if (refreshCall) {
+        thread_call_cancel_wait(refreshCall);
+        thread_call_free(refreshCall);
+        refreshCall = nullptr;
+    }
+    OSSafeReleaseNULL(refreshMedia);
+    OSSafeReleaseNULL(readyDevices);
+    if (historyCall) {
+        thread_call_cancel_wait(historyCall);
+        thread_call_free(historyCall);
+        historyCall = nullptr;
+    }
+    if (benchmarkCall) {
+        thread_call_cancel_wait(benchmarkCall);
+        thread_call_free(benchmarkCall);
+        benchmarkCall = nullptr;
+    }
+    if (passLock) {
+        IOLockFree(passLock);
+        passLock = nullptr;
+    }
+    if (startCall) {
+        thread_call_cancel_wait(startCall);
+        thread_call_free(startCall);
+        startCall = nullptr;
+    }
+    if (patchLock) {
+        IOLockFree(patchLock);
+        patchLock = nullptr;
+    }
     super::free();
 }
 
@@ -34,85 +104,1113 @@ IOService *Innie::probe(IOService *provider, SInt32 *score) {
 }
 
 bool Innie::start(IOService *provider) {
-    DBGLOG("starting\n");
-    
     if (!super::start(provider))
         return false;
     
-    processRoot();
+    startTime = mach_absolute_time();
+    readConfiguration();
+    DBGLOG("starting in %s mode with %u workers\n", modeNames[config.mode], config.workers);
+    
+    if (config.mode == Configuration::Off) {
+        super::registerService();
+        return true;
+    }
+    
+    if (!allocateWalkPool()) {
+        DBGLOG("failed to allocate walk pool\n");
+        return false;
+    }
+    
+    // Shared by every patched entry rather than created for each of them
+    internal = OSString::withCString("Internal");
+    internalIcon = OSString::withCString("Internal.icns");
+    if (!internal || !internalIcon || (config.repair && !createRepairMatching()))
+        return false;
+    
+    patchLock = IOLockAlloc();
+    domainStats = OSArray::withCapacity(2);
+    processedEntries = OSSet::withCapacity(8);
+    pendingVolumes = OSSet::withCapacity(2);
+    terminatedDevices = OSArray::withCapacity(2);
+    refreshMedia = OSSet::withCapacity(8);
+    readyDevices = OSArray::withCapacity(2);
+    refreshCall = thread_call_allocate(&Innie::refreshWorker, this);
+    passLock = IOLockAlloc();
+    benchmarkCall = thread_call_allocate(&Innie::benchmarkWorker, this);
+    historyCall = thread_call_allocate(&Innie::historyWorker, this);
+    if (!patchLock || !domainStats || !processedEntries || !pendingVolumes || !terminatedDevices || !refreshMedia || !readyDevices || !refreshCall || !passLock || !benchmarkCall || !historyCall) {
+        DBGLOG("failed to allocate patch state\n");
+        return false;
+    }
+    
+    // Record what would be changed instead of changing it
+    dryRun = config.mode == Configuration::DryRun;
+    if (dryRun) {
+        plan = OSArray::withCapacity(16);
+        plannedEntries = OSSet::withCapacity(16);
+        if (!plan || !plannedEntries)
+            return false;
+    }
+    
+    if (config.mode == Configuration::Asynchronous) {
+        startCall = thread_call_allocate(&Innie::startWorker, this);
+        if (!startCall)
+            return false;
+    }
+    
+    // Storage drivers that terminate and rematch later publish fresh External properties.
+    // Installed last, nothing can fail after this point.
+    addStorageNotifications();
+    
+    if (startCall) {
+        // The thread call holds a reference until the passes are done
+        retain();
+        thread_call_enter(startCall);
+        return true;
+    }
+    
+    runPasses();
+    return true;
+}
+
+void Innie::startWorker(thread_call_param_t param0, thread_call_param_t param1) {
+    auto that = static_cast<Innie *>(param0);
+    that->runPasses();
+    that->release();
+}
+
+void Innie::runPasses() {
+    IOLockLock(passLock);
+    int64_t before[allocation::Count];
+    snapshotAllocations(before);
+    
+    // The fast path leaves finding the drives to the IOPCIDevice publish notification
+    if (config.mode != Configuration::FastPath)
+        processRoot();
+    
+    if (config.repair) {
+        auto begin = mach_absolute_time();
+        repairExternal();
+        recordPhase(phase::Repair, begin);
+    }
+    recordPass(pass::Boot, before);
+    IOLockUnlock(passLock);
+    publishStatistics();
+    if (dryRun)
+        publishPlan();
+    
+    if (config.mode != Configuration::FastPath) {
+        if (auto matching = serviceMatching("IOPCIBridge")) {
+            hostBridgeNotifiers[0] = addMatchingNotification(gIOPublishNotification, matching, &Innie::hostBridgePublished, this);
+            hostBridgeNotifiers[1] = addMatchingNotification(gIOTerminatedNotification, matching, &Innie::hostBridgeTerminated, this);
+            matching->release();
+        }
+    }
+    
+    IOLockLock(patchLock);
+    absolutetime_to_nanoseconds(mach_absolute_time() - startTime, &registerTime);
+    IOLockUnlock(patchLock);
     super::registerService();
+    
+    // A dry run leaves NVRAM alone like everything else. The boot benchmark waits for the
+    // history so that the figures of this boot are recorded before it runs.
+    if (config.history && !dryRun)
+        thread_call_enter(historyCall);
+    else if (config.benchmark)
+        thread_call_enter1(benchmarkCall, reinterpret_cast<thread_call_param_t>(static_cast<uintptr_t>(config.benchmark)));
+}
+
+void Innie::readConfiguration() {
+    Configuration parsed;
+    
+    // Personality keys come first, boot arguments override them
+    char mode[16] {};
+    if (auto name = OSDynamicCast(OSString, getProperty("InnieMode")))
+        strlcpy(mode, name->getCStringNoCopy(), sizeof(mode));
+    PE_parse_boot_argn("innie_mode", mode, sizeof(mode));
+    bool known = !mode[0];
+    for (uint32_t i = 0; i < sizeof(modeNames) / sizeof(modeNames[0]); i++) {
+        if (!strcmp(mode, modeNames[i])) {
+            parsed.mode = i;
+            known = true;
+        }
+    }
+    if (!known)
+        IOLog("Innie: unknown mode %s, using %s\n", mode, modeNames[parsed.mode]);
+    
+    char dummy = 0;
+    if (PE_parse_boot_argn("-inniedryrun", &dummy, sizeof(dummy)))
+        parsed.mode = Configuration::DryRun;
+    if (PE_parse_boot_argn("-innieoff", &dummy, sizeof(dummy)))
+        parsed.mode = Configuration::Off;
+    
+    parsed.rootTimeout = readNumber("InnieRootTimeout", "innie_root_timeout", parsed.rootTimeout);
+    parsed.bridgeTimeout = readNumber("InnieBridgeTimeout", "innie_bridge_timeout", parsed.bridgeTimeout);
+    parsed.logLevel = readNumber("InnieLogLevel", "innie_log", parsed.logLevel);
+    parsed.workers = readNumber("InnieWorkers", "innie_workers", parsed.workers);
+    parsed.sliceBudget = readNumber("InnieSliceBudget", "innie_slice", parsed.sliceBudget);
+    parsed.refreshWindow = readNumber("InnieRefreshWindow", "innie_refresh", parsed.refreshWindow);
+    parsed.benchmark = readNumber("InnieBenchmark", "innie_bench", parsed.benchmark);
+    parsed.history = readNumber("InnieHistory", "innie_history", parsed.history);
+    parsed.repair = readNumber("InnieRepair", "innie_repair", parsed.repair);
+    
+    if (parsed.workers < 1)
+        parsed.workers = 1;
+    if (parsed.workers > maxWalkWorkers)
+        parsed.workers = maxWalkWorkers;
+    
+    config = parsed;
+}
+
+uint32_t Innie::readNumber(const char *key, const char *bootArg, uint32_t value) {
+    if (auto number = OSDynamicCast(OSNumber, getProperty(key)))
+        value = number->unsigned32BitValue();
+    PE_parse_boot_argn(bootArg, &value, sizeof(value));
+    return value;
+}
+
+bool Innie::waitForProperty(IORegistryEntry *entry, const char *key, uint32_t timeout) {
+    uint64_t deadline = 0;
+    if (timeout)
+        clock_interval_to_deadline(timeout, kMillisecondScale, &deadline);
+    
+    while (OSDynamicCast(OSBoolean, entry->getProperty(key)) != kOSBooleanTrue) {
+        if (deadline && mach_absolute_time() >= deadline) {
+            DBGLOG("timed out waiting for %s on %s", key, entry->getName());
+            if (measuring())
+                OSIncrementAtomic64(&timeouts);
+            return false;
+        }
+        IOSleep(1);
+    }
+    
     return true;
 }
 
 void Innie::stop(IOService *provider) {
+    // Let passes still running in async mode finish before removing what they install,
+    // and drop the reference held for them if they never got to run
+    if (startCall && thread_call_cancel_wait(startCall))
+        release();
+    
+    for (auto &notifier : storageNotifiers) {
+        if (notifier) {
+            notifier->remove();
+            notifier = nullptr;
+        }
+    }
+    for (auto &notifier : hostBridgeNotifiers) {
+        if (notifier) {
+            notifier->remove();
+            notifier = nullptr;
+        }
+    }
+    if (rootCall)
+        thread_call_cancel_wait(rootCall);
+    // The history worker enters the boot benchmark, so it has to be gone first
+    if (historyCall)
+        thread_call_cancel_wait(historyCall);
+    if (benchmarkCall)
+        thread_call_cancel_wait(benchmarkCall);
+    
+    if (processedEntries) {
+        trackObjects(-static_cast<int64_t>(processedEntries->getCount()));
+        processedEntries->flushCollection();
+    }
+    if (pendingVolumes) {
+        trackObjects(-static_cast<int64_t>(pendingVolumes->getCount()));
+        pendingVolumes->flushCollection();
+    }
+    if (terminatedDevices) {
+        trackObjects(-static_cast<int64_t>(terminatedDevices->getCount()));
+        terminatedDevices->flushCollection();
+    }
+    
+    if (refreshCall)
+        thread_call_cancel_wait(refreshCall);
+    if (refreshMedia) {
+        trackObjects(-static_cast<int64_t>(refreshMedia->getCount()));
+        refreshMedia->flushCollection();
+    }
+    refreshScheduled = false;
+    if (readyDevices) {
+        trackObjects(-static_cast<int64_t>(readyDevices->getCount()));
+        readyDevices->flushCollection();
+    }
+    if (plannedEntries) {
+        trackObjects(-static_cast<int64_t>(plannedEntries->getCount()));
+        plannedEntries->flushCollection();
+    }
+    
+    if (walkLock) {
+        IOLockLock(walkLock);
+        trackObjects(-static_cast<int64_t>(deferredBridges->getCount() + processedRoots->getCount() + lateRoots->getCount()));
+        deferredBridges->flushCollection();
+        processedRoots->flushCollection();
+        lateRoots->flushCollection();
+        IOLockUnlock(walkLock);
+    }
+    
     super::stop(provider);
 }
 
 void Innie::processRoot() {
-    if (auto entry = IORegistryEntry::fromPath("/AppleACPIPlatformExpert", gIOServicePlane)) {
-        IORegistryEntry *pciRoot = nullptr;
-        size_t repeat = 0;
-        bool found = false;
-        
-        do {
-            if (auto iterator = entry->getChildIterator(gIOServicePlane)) {
-                while ((pciRoot = OSDynamicCast(IORegistryEntry, iterator->getNextObject())) != nullptr) {
-                    const char *name = pciRoot->getName();
-                    if (name && !strncmp("PC", name, 2)) {
-                        found = true;
-                        DBGLOG("found PCI root %s", pciRoot->getName());
-                        while (OSDynamicCast(OSBoolean, pciRoot->getProperty("IOPCIConfigured")) != kOSBooleanTrue) {
-                            DBGLOG("waiting for PCI root to be configured");
-                            IOSleep(1);
-                        }
-                        recurseBridge(pciRoot);
-                    }
-                }
-                iterator->release();
+    auto matching = serviceMatching("IOPCIBridge");
+    if (!matching)
+        return;
+    
+    // Wait for the first domain to appear, the others are published along with it or picked up later
+    auto discoveryBegin = mach_absolute_time();
+    uint64_t timeout = config.rootTimeout ? config.rootTimeout * 1000000ULL : UINT64_MAX;
+    if (auto first = waitForMatchingService(matching, timeout))
+        first->release();
+    
+    auto iterator = getMatchingServices(matching);
+    if (iterator)
+        countAllocation(allocation::Iterators);
+    matching->release();
+    
+    // Collect the host bridges first, so that discovery and walk are timed apart
+    auto hostBridges = OSArray::withCapacity(2);
+    if (iterator && hostBridges) {
+        while (auto bridge = OSDynamicCast(IOService, iterator->getNextObject())) {
+            if (claimHostBridge(bridge))
+                hostBridges->setObject(bridge);
+        }
+    }
+    if (iterator)
+        iterator->release();
+    recordPhase(phase::Discovery, discoveryBegin);
+    
+    if (hostBridges) {
+        // Every domain is queued as soon as it is configured, so that they are all walked by the pool at once
+        auto begin = mach_absolute_time();
+        for (unsigned int i = 0; i < hostBridges->getCount(); i++)
+            queueDomain(OSDynamicCast(IOService, hostBridges->getObject(i)), config.rootTimeout);
+        drainWalk();
+        recordDomains();
+        recordPhase(phase::Walk, begin);
+        hostBridges->release();
+    }
+}
+
+bool Innie::isHostBridge(IOService *bridge) {
+    // Bridges between two PCI buses are walked as part of their domain, everything else is a host bridge
+    return bridge->metaCast("IOPCIBridge") && !bridge->metaCast("IOPCI2PCIBridge") && bridge->getProvider();
+}
+
+bool Innie::claimHostBridge(IOService *bridge) {
+    if (!isHostBridge(bridge))
+        return false;
+    
+    // Benchmark runs walk every domain again
+    if (inBenchmark())
+        return true;
+    
+    IOLockLock(walkLock);
+    bool claimed = !processedRoots->containsObject(bridge);
+    if (claimed) {
+        processedRoots->setObject(bridge);
+        trackObjects(1);
+    }
+    IOLockUnlock(walkLock);
+    
+    return claimed;
+}
+
+void Innie::queueDomain(IOService *hostBridge, uint32_t timeout) {
+    // Devices of the domain are attached to the provider of the host bridge in the device tree plane
+    auto root = hostBridge->getProvider();
+    DBGLOG("found PCI root %s", root->getName());
+    INNIE_TRACE(traceCode::RootFound, DBG_FUNC_NONE, root->getRegistryEntryID(), hostBridge->getRegistryEntryID());
+    
+    auto begin = mach_absolute_time();
+    DBGLOG("waiting for PCI root to be configured");
+    bool configured = waitForProperty(root, "IOPCIConfigured", timeout);
+    uint64_t configureWait = 0;
+    absolutetime_to_nanoseconds(mach_absolute_time() - begin, &configureWait);
+    
+    // Walk times are attributed per domain, so more domains than slots finish the walk so far first
+    if (walkDomainCount == maxWalkDomains) {
+        drainWalk();
+        recordDomains();
+    }
+    
+    root->retain();
+    IOLockLock(walkLock);
+    auto domain = walkDomainCount;
+    walkDomains[domain] = {root, 0, mach_absolute_time(), 0, 0, configureWait, configured};
+    walkDomainCount++;
+    IOLockUnlock(walkLock);
+    
+    if (configured)
+        queueBridge(root, 0, domain);
+}
+
+size_t Innie::findDomain(IORegistryEntry *bridge) {
+    // Domains are only ever appended while walking, and the one of a queued bridge was added before it
+    size_t count = walkDomainCount;
+    if (count == 1)
+        return 0;
+    
+    for (auto entry = bridge; entry; entry = entry->getParentEntry(gIODTPlane)) {
+        for (size_t i = 0; i < count; i++) {
+            if (walkDomains[i].root == entry)
+                return i;
+        }
+    }
+    return 0;
+}
+
+void Innie::recordDomains() {
+    IOLockLock(walkLock);
+    auto count = walkDomainCount;
+    walkDomainCount = 0;
+    IOLockUnlock(walkLock);
+    
+    for (size_t i = 0; i < count; i++) {
+        auto &walked = walkDomains[i];
+        uint64_t walkTime = 0;
+        if (walked.finished)
+            absolutetime_to_nanoseconds(walked.finished - walked.queued, &walkTime);
+        
+        if (!inBenchmark()) {
+            auto domain = OSDictionary::withCapacity(5);
+            auto name = OSString::withCString(walked.root->getName());
+            if (domain)
+                countAllocation(allocation::Dictionaries);
+            if (name)
+                countAllocation(allocation::Strings);
+            if (domain && name) {
+                domain->setObject("Name", name);
+                setNumber(domain, "Configured", walked.configured);
+                setNumber(domain, "ConfigureWait", walked.configureWait);
+                setNumber(domain, "WalkTime", walkTime);
+                setNumber(domain, "Devices", walked.devices);
+                IOLockLock(patchLock);
+                domainStats->setObject(domain);
+                IOLockUnlock(patchLock);
             }
-        } while (repeat++ < 0x10000000 && !found);
+            OSSafeReleaseNULL(domain);
+            OSSafeReleaseNULL(name);
+        }
+        
+        walked.root->release();
+        walked.root = nullptr;
+    }
+}
+
+bool Innie::hostBridgePublished(void *target, void *refCon, IOService *newService, IONotifier *notifier) {
+    auto that = static_cast<Innie *>(target);
+    
+    // Domains published after the boot pass, by another driver for instance, are walked on their own
+    if (that->claimHostBridge(newService)) {
+        DBGLOG("found late PCI host bridge %s", newService->getName());
+        IOLockLock(that->walkLock);
+        that->lateRoots->setObject(newService);
+        that->trackObjects(1);
+        IOLockUnlock(that->walkLock);
+        thread_call_enter(that->rootCall);
+    }
+    
+    return true;
+}
+
+bool Innie::hostBridgeTerminated(void *target, void *refCon, IOService *newService, IONotifier *notifier) {
+    auto that = static_cast<Innie *>(target);
+    
+    // Forget the bridge, so that nothing is kept alive for a domain that is gone
+    IOLockLock(that->walkLock);
+    if (that->processedRoots->containsObject(newService)) {
+        that->processedRoots->removeObject(newService);
+        that->trackObjects(-1);
+    }
+    auto index = that->lateRoots->getNextIndexOfObject(newService, 0);
+    if (index != (unsigned int)-1) {
+        that->lateRoots->removeObject(index);
+        that->trackObjects(-1);
+    }
+    IOLockUnlock(that->walkLock);
+    
+    return true;
+}
+
+void Innie::rootWorker(thread_call_param_t param0, thread_call_param_t param1) {
+    auto that = static_cast<Innie *>(param0);
+    
+    // Late domains published together are walked together
+    IOLockLock(that->passLock);
+    int64_t before[allocation::Count];
+    that->snapshotAllocations(before);
+    while (true) {
+        IOService *bridge = nullptr;
+        IOLockLock(that->walkLock);
+        if (auto count = that->lateRoots->getCount()) {
+            bridge = OSDynamicCast(IOService, that->lateRoots->getObject(count - 1));
+            bridge->retain();
+            that->lateRoots->removeObject(count - 1);
+            that->trackObjects(-1);
+        }
+        IOLockUnlock(that->walkLock);
+        
+        if (!bridge)
+            break;
         
-        DBGLOG("found PCI root in %lu attempts", repeat);
-        entry->release();
+        // passLock is held meanwhile, so a root that is never configured must not block stop()
+        if (!bridge->isInactive())
+            that->queueDomain(bridge, config.rootTimeout ? config.rootTimeout : lateRootTimeout);
+        bridge->release();
+    }
+    that->drainWalk();
+    that->recordDomains();
+    that->recordPass(pass::LateDomain, before);
+    IOLockUnlock(that->passLock);
+    
+    that->publishStatistics();
+}
+
+void Innie::historyWorker(thread_call_param_t param0, thread_call_param_t param1) {
+    auto that = static_cast<Innie *>(param0);
+    that->recordHistory();
+    that->publishStatistics();
+    if (config.benchmark)
+        thread_call_enter1(that->benchmarkCall, reinterpret_cast<thread_call_param_t>(static_cast<uintptr_t>(config.benchmark)));
+}
+
+void Innie::recordHistory() {
+    // NVRAM is published long before the boot pass ends, do not hold on to the thread call if it is missing
+    IOService *service = nullptr;
+    if (auto matching = serviceMatching("IODTNVRAM")) {
+        service = waitForMatchingService(matching, 5000 * 1000000ULL);
+        matching->release();
+    }
+    auto nvram = OSDynamicCast(IODTNVRAM, service);
+    if (!nvram) {
+        DBGLOG("no NVRAM to keep the history in");
+        OSSafeReleaseNULL(service);
+        return;
     }
+    
+    InnieHistory boots;
+    if (auto stored = nvram->copyProperty("innie-history")) {
+        if (auto data = OSDynamicCast(OSData, stored))
+            boots.decode(static_cast<const uint8_t *>(data->getBytesNoCopy()), data->getLength());
+        stored->release();
+    }
+    
+    // Times are kept in milliseconds
+    InnieHistory::Boot boot {};
+    uint8_t buffer[InnieHistory::maxSize];
+    IOLockLock(patchLock);
+    boot.totalTime = InnieHistory::clamp32(registerTime / 1000000);
+    boot.bridgeWait = InnieHistory::clamp32(bridgeWaitTime / 1000000);
+    boot.drives = InnieHistory::clamp16(internalizedDevices);
+    boot.timeouts = InnieHistory::clamp16(timeouts);
+    boots.append(boot, config.history);
+    history = boots;
+    auto length = history.encode(buffer, sizeof(buffer));
+    IOLockUnlock(patchLock);
+    
+    // One write of at most InnieHistory::maxSize bytes per boot
+    if (auto data = OSData::withBytes(buffer, static_cast<unsigned>(length))) {
+        nvram->setProperty("innie-history", data);
+        nvram->sync();
+        data->release();
+    }
+    nvram->release();
+}
+
+IOReturn Innie::setProperties(OSObject *properties) {
+    // Administrators can start a benchmark run after boot by setting InnieBenchmark to the number of iterations
+    auto dict = OSDynamicCast(OSDictionary, properties);
+    auto iterations = dict ? OSDynamicCast(OSNumber, dict->getObject("InnieBenchmark")) : nullptr;
+    if (!iterations)
+        return kIOReturnUnsupported;
+    if (IOUserClient::clientHasPrivilege(current_task(), kIOClientPrivilegeAdministrator) != kIOReturnSuccess)
+        return kIOReturnNotPrivileged;
+    if (!benchmarkCall || isInactive())
+        return kIOReturnNotReady;
+    
+    thread_call_enter1(benchmarkCall, reinterpret_cast<thread_call_param_t>(static_cast<uintptr_t>(iterations->unsigned32BitValue())));
+    return kIOReturnSuccess;
 }
 
-void Innie::recurseBridge(IORegistryEntry *entry) {
+void Innie::benchmarkWorker(thread_call_param_t param0, thread_call_param_t param1) {
+    auto that = static_cast<Innie *>(param0);
+    that->runBenchmark(static_cast<uint32_t>(reinterpret_cast<uintptr_t>(param1)));
+}
+
+void Innie::runBenchmark(uint32_t iterations) {
+    if (iterations > maxBenchmarkIterations)
+        iterations = maxBenchmarkIterations;
+    if (!iterations)
+        return;
+    
+    IOLockLock(passLock);
+    
+    // Each iteration overwrites the phase times and repair counters, keep those of the boot pass.
+    // Everything else measured is left alone by measuring() until the benchmark is over.
+    uint64_t bootPhases[phase::Count];
+    memcpy(bootPhases, phaseTime, sizeof(bootPhases));
+    auto bootRepair = repairStats;
+    int64_t benchmarkVisited = 0;
+    benchmarkThread = current_thread();
+    
+    for (uint32_t i = 0; i < iterations; i++) {
+        auto visited = visitedEntries;
+        int64_t before[allocation::Count];
+        snapshotAllocations(before);
+        processRoot();
+        if (config.repair) {
+            auto begin = mach_absolute_time();
+            repairExternal();
+            recordPhase(phase::Repair, begin);
+        }
+        recordPass(pass::Benchmark, before);
+        
+        for (size_t p = 0; p < phase::Count; p++)
+            benchmark.time[p][i] = phaseTime[p];
+        benchmark.visited[i] = visitedEntries - visited;
+        benchmarkVisited += benchmark.visited[i];
+    }
+    
+    benchmarkThread = nullptr;
+    memcpy(phaseTime, bootPhases, sizeof(bootPhases));
+    repairStats = bootRepair;
+    OSAddAtomic64(-benchmarkVisited, &visitedEntries);
+    publishBenchmark(iterations);
+    IOLockUnlock(passLock);
+}
+
+bool Innie::inBenchmark() {
+    // Only the thread running the benchmark skips the changes, notifications keep patching meanwhile
+    return benchmarkThread && benchmarkThread == current_thread();
+}
+
+bool Innie::measuring() {
+    // The walks of a benchmark run on the pool's threads too, so nothing is counted or timed until it is over
+    return !benchmarkThread;
+}
+
+void Innie::publishBenchmark(uint32_t iterations) {
+    auto results = OSDictionary::withCapacity(3);
+    auto phases = OSDictionary::withCapacity(phase::Count);
+    if (results && phases) {
+        for (size_t p = 0; p < phase::Count; p++)
+            setSummary(phases, phaseNames[p], benchmark.time[p], iterations);
+        setNumber(results, "Iterations", iterations);
+        results->setObject("PhaseTime", phases);
+        setSummary(results, "VisitedEntries", benchmark.visited, iterations);
+        setProperty("InnieBenchmarkResults", results);
+    }
+    
+    OSSafeReleaseNULL(results);
+    OSSafeReleaseNULL(phases);
+}
+
+void Innie::setSummary(OSDictionary *dict, const char *key, uint64_t *values, size_t count) {
+    // Sorts the samples in place, there are never more than maxBenchmarkIterations of them
+    for (size_t i = 1; i < count; i++) {
+        auto value = values[i];
+        size_t j = i;
+        for (; j > 0 && values[j - 1] > value; j--)
+            values[j] = values[j - 1];
+        values[j] = value;
+    }
+    
+    if (auto summary = OSDictionary::withCapacity(3)) {
+        setNumber(summary, "Min", values[0]);
+        setNumber(summary, "Median", values[count / 2]);
+        setNumber(summary, "Max", values[count - 1]);
+        dict->setObject(key, summary);
+        summary->release();
+    }
+}
+
+void Innie::recurseBridge(IORegistryEntry *entry, size_t worker, size_t domain) {
     if (auto iterator = entry->getChildIterator(gIODTPlane)) {
         IORegistryEntry *childEntry = nullptr;
+        countAllocation(allocation::Iterators);
         
         // Go through child entries of bridge, finding every other bridge and every SATA and NVMe device
         while ((childEntry = OSDynamicCast(IORegistryEntry, iterator->getNextObject())) != nullptr) {
-            uint32_t code = 0;
-            if (auto class_code = childEntry->getProperty("class-code")) {
-                if (auto codeData = OSDynamicCast(OSData, class_code)) {
-                    code=*(uint32_t*)codeData->getBytesNoCopy();
-                    if (code == classCode::SATADevice || code == classCode::NVMeDevice){
-                        DBGLOG("found device %s", childEntry->getName());
-                        if (auto built_in = childEntry->getProperty("built-in")) {
-                            DBGLOG("device is already built-in");
-                        } else {
-                            internalizeDevice(childEntry);
-                        }
-                        break;
-                    }
-                    if (code == classCode::PCIBridge) {
-                        DBGLOG("found bridge %s", childEntry->getName());
-                        while (OSDynamicCast(OSBoolean, childEntry->getProperty("IOPCIResourced")) != kOSBooleanTrue) {
-                            DBGLOG("waiting for bridge to be resourced");
-                            IOSleep(1);
-                        }
-                        recurseBridge(childEntry);
-                    }
+            OSIncrementAtomic64(&visitedEntries);
+            uint32_t code = getClassCode(childEntry);
+            
+            if (code == classCode::SATADevice || code == classCode::NVMeDevice){
+                DBGLOG("found device %s", childEntry->getName());
+                // Benchmark runs go through built-in devices as well, walks never overlap them
+                if (!benchmarkThread && childEntry->getProperty("built-in")) {
+                    DBGLOG("device is already built-in");
+                } else {
+                    queueDevice(childEntry, domain);
                 }
+                // Keep going, SR-IOV virtual functions and other functions of the device are siblings
+                continue;
+            }
+            if (code == classCode::PCIBridge) {
+                DBGLOG("found bridge %s", childEntry->getName());
+                queueBridge(childEntry, worker, domain);
             }
         }
         iterator->release();
     }
 }
-                                    
+
+bool Innie::allocateWalkPool() {
+    walkLock = IOLockAlloc();
+    pendingDevices = OSArray::withCapacity(4);
+    deferredBridges = OSSet::withCapacity(2);
+    processedRoots = OSSet::withCapacity(2);
+    lateRoots = OSArray::withCapacity(1);
+    rootCall = thread_call_allocate(&Innie::rootWorker, this);
+    if (!walkLock || !pendingDevices || !deferredBridges || !processedRoots || !lateRoots || !rootCall)
+        return false;
+    
+    for (size_t i = 0; i < config.workers; i++) {
+        walkQueues[i] = OSArray::withCapacity(8);
+        walkCalls[i] = thread_call_allocate_with_priority(&Innie::walkWorker, this, THREAD_CALL_PRIORITY_KERNEL);
+        if (!walkQueues[i] || !walkCalls[i])
+            return false;
+    }
+    
+    return true;
+}
+
+void Innie::freeWalkPool() {
+    for (size_t i = 0; i < maxWalkWorkers; i++) {
+        if (walkCalls[i]) {
+            thread_call_cancel_wait(walkCalls[i]);
+            thread_call_free(walkCalls[i]);
+            walkCalls[i] = nullptr;
+        }
+        OSSafeReleaseNULL(walkQueues[i]);
+    }
+    
+    OSSafeReleaseNULL(pendingDevices);
+    OSSafeReleaseNULL(deferredBridges);
+    OSSafeReleaseNULL(processedRoots);
+    OSSafeReleaseNULL(lateRoots);
+    if (rootCall) {
+        thread_call_cancel_wait(rootCall);
+        thread_call_free(rootCall);
+        rootCall = nullptr;
+    }
+    if (walkLock) {
+        IOLockFree(walkLock);
+        walkLock = nullptr;
+    }
+}
+
+void Innie::queueBridge(IORegistryEntry *bridge, size_t worker, size_t domain) {
+    IOLockLock(walkLock);
+    walkQueues[worker]->setObject(bridge);
+    trackObjects(1);
+    walkPending++;
+    walkDomains[domain].pending++;
+    
+    // Wake every idle worker so that it can steal the new bridge
+    for (size_t i = 0; i < config.workers; i++) {
+        if (!walkActive[i]) {
+            walkActive[i] = true;
+            thread_call_enter1(walkCalls[i], reinterpret_cast<thread_call_param_t>(i));
+        }
+    }
+    IOLockUnlock(walkLock);
+}
+
+IORegistryEntry *Innie::takeBridge(size_t worker) {
+    IORegistryEntry *bridge = nullptr;
+    
+    // Take the most recently queued bridge of our own, otherwise steal the oldest one of another worker
+    IOLockLock(walkLock);
+    if (auto count = walkQueues[worker]->getCount()) {
+        bridge = OSDynamicCast(IORegistryEntry, walkQueues[worker]->getObject(count - 1));
+        bridge->retain();
+        walkQueues[worker]->removeObject(count - 1);
+        trackObjects(-1);
+    } else {
+        for (size_t i = 1; i < config.workers && !bridge; i++) {
+            auto victim = walkQueues[(worker + i) % config.workers];
+            if (victim->getCount() > 0) {
+                bridge = OSDynamicCast(IORegistryEntry, victim->getObject(0));
+                bridge->retain();
+                victim->removeObject(0);
+                trackObjects(-1);
+            }
+        }
+    }
+    
+    if (!bridge)
+        walkActive[worker] = false;
+    IOLockUnlock(walkLock);
+    
+    return bridge;
+}
+
+void Innie::queueDevice(IORegistryEntry *device, size_t domain) {
+    IOLockLock(walkLock);
+    pendingDevices->setObject(device);
+    trackObjects(1);
+    walkDomains[domain].devices++;
+    IOLockWakeup(walkLock, &walkPending, false);
+    IOLockUnlock(walkLock);
+}
+
+void Innie::drainWalk() {
+    IOLockLock(walkLock);
+    
+    // Devices are only ever patched from here, so all registry mutations stay on this thread
+    while (true) {
+        if (auto count = pendingDevices->getCount()) {
+            auto device = OSDynamicCast(IORegistryEntry, pendingDevices->getObject(count - 1));
+            device->retain();
+            pendingDevices->removeObject(count - 1);
+            trackObjects(-1);
+            IOLockUnlock(walkLock);
+            
+            // patchLock is only taken around the shared patch state, not the registry updates
+            internalizeDevice(device);
+            announceReady();
+            device->release();
+            
+            IOLockLock(walkLock);
+            continue;
+        }
+        
+        if (walkPending == 0)
+            break;
+        
+        IOLockSleep(walkLock, &walkPending, THREAD_UNINT);
+    }
+    
+    IOLockUnlock(walkLock);
+}
+
+void Innie::walkWorker(thread_call_param_t param0, thread_call_param_t param1) {
+    auto that = static_cast<Innie *>(param0);
+    auto worker = reinterpret_cast<size_t>(param1);
+    auto sliceBegin = mach_absolute_time();
+    uint64_t waited = 0;
+    uint64_t budget = 0;
+    nanoseconds_to_absolutetime(config.sliceBudget * 1000ULL, &budget);
+    
+    while (auto bridge = that->takeBridge(worker)) {
+        auto domain = that->findDomain(bridge);
+        
+        // Only bridges below the root need to wait for their resources
+        if (getClassCode(bridge) == classCode::PCIBridge) {
+            if (isHotPlugBridge(bridge) && that->deferBridge(bridge)) {
+                DBGLOG("deferring hot-plug bridge %s", bridge->getName());
+                bridge->release();
+                that->finishBridge(domain);
+                continue;
+            }
+            
+            DBGLOG("waiting for bridge to be resourced");
+            auto begin = mach_absolute_time();
+            INNIE_TRACE(traceCode::BridgeWait, DBG_FUNC_START, bridge->getRegistryEntryID(), worker);
+            bool resourced = that->waitForProperty(bridge, "IOPCIResourced", config.bridgeTimeout);
+            INNIE_TRACE(traceCode::BridgeWait, DBG_FUNC_END, bridge->getRegistryEntryID(), resourced);
+            
+            // Time asleep waiting for the bridge is not part of the slice
+            auto wait = mach_absolute_time() - begin;
+            waited += wait;
+            uint64_t elapsed = 0;
+            absolutetime_to_nanoseconds(wait, &elapsed);
+            if (that->measuring())
+                OSAddAtomic64(static_cast<int64_t>(elapsed), &that->bridgeWaitTime);
+            
+            if (!resourced) {
+                bridge->release();
+                that->finishBridge(domain);
+                continue;
+            }
+        }
+        
+        that->recurseBridge(bridge, worker, domain);
+        bridge->release();
+        that->finishBridge(domain);
+        
+        // Give the CPU back between slices for a tenth of the budget, the queued bridges are where the next slice resumes
+        if (mach_absolute_time() - sliceBegin - waited >= budget) {
+            if (that->measuring())
+                recordAccess(that->sliceStats, sliceBegin + waited);
+            thread_call_enter1_delayed(that->walkCalls[worker], param1, mach_absolute_time() + budget / 10);
+            return;
+        }
+    }
+    
+    if (that->measuring())
+        recordAccess(that->sliceStats, sliceBegin + waited);
+}
+
+void Innie::finishBridge(size_t domain) {
+    IOLockLock(walkLock);
+    walkPending--;
+    if (--walkDomains[domain].pending == 0)
+        walkDomains[domain].finished = mach_absolute_time();
+    IOLockWakeup(walkLock, &walkPending, false);
+    IOLockUnlock(walkLock);
+}
+
+bool Innie::isHotPlugBridge(IORegistryEntry *bridge) {
+    return bridge->getProperty("PCI-Thunderbolt") || bridge->getProperty("PCIHotplugCapable");
+}
+
+bool Innie::deferBridge(IORegistryEntry *bridge) {
+    // Devices behind a bridge are only published once it is resourced, so checking again under the lock
+    // guarantees that hotPlugPublished() sees the bridge before any of them arrive
+    IOLockLock(walkLock);
+    bool deferred = OSDynamicCast(OSBoolean, bridge->getProperty("IOPCIResourced")) != kOSBooleanTrue;
+    if (deferred && deferredBridges->setObject(bridge))
+        trackObjects(1);
+    IOLockUnlock(walkLock);
+    
+    return deferred;
+}
+
+bool Innie::hotPlugPublished(void *target, void *refCon, IOService *newService, IONotifier *notifier) {
+    auto that = static_cast<Innie *>(target);
+    
+    auto code = getClassCode(newService);
+    if (code != classCode::SATADevice && code != classCode::NVMeDevice)
+        return true;
+    
+    // The fast path internalizes every storage device as it is published instead of walking,
+    // otherwise only devices arriving behind a deferred bridge are left for us to handle
+    bool fastPath = config.mode == Configuration::FastPath;
+    bool deferred = false;
+    IOLockLock(that->walkLock);
+    if (that->deferredBridges->getCount() > 0) {
+        for (auto parent = newService->getParentEntry(gIODTPlane); parent && !deferred; parent = parent->getParentEntry(gIODTPlane))
+            deferred = that->deferredBridges->containsObject(parent);
+    }
+    IOLockUnlock(that->walkLock);
+    
+    if (!deferred && !fastPath)
+        return true;
+    
+    if (!that->isBuiltIn(newService)) {
+        DBGLOG("found %s device %s", deferred ? "hot-plug" : "published", newService->getName());
+        that->internalizeDevice(newService);
+        if (deferred) {
+            IOLockLock(that->patchLock);
+            that->hotPlugDevices++;
+            IOLockUnlock(that->patchLock);
+        }
+    }
+    that->announceReady();
+    
+    return true;
+}
+
+uint32_t Innie::getClassCode(IORegistryEntry *entry) {
+    if (auto codeData = OSDynamicCast(OSData, entry->getProperty("class-code"))) {
+        if (codeData->getLength() >= sizeof(uint32_t))
+            return *(const uint32_t *)codeData->getBytesNoCopy();
+    }
+    return 0;
+}
+
+bool Innie::createRepairMatching() {
+    auto external = OSString::withCString("External");
+    auto externalIcon = OSDictionary::withCapacity(2);
+    if (!external || !externalIcon) {
+        OSSafeReleaseNULL(external);
+        OSSafeReleaseNULL(externalIcon);
+        return false;
+    }
+    countAllocation(allocation::Strings);
+    countAllocation(allocation::Dictionaries);
+    
+    if (auto bundle = OSString::withCString("com.apple.iokit.IOStorageFamily")) {
+        countAllocation(allocation::Strings);
+        externalIcon->setObject("CFBundleIdentifier", bundle);
+        bundle->release();
+    }
+    if (auto file = OSString::withCString("External.icns")) {
+        countAllocation(allocation::Strings);
+        externalIcon->setObject("IOBundleResourceFile", file);
+        file->release();
+    }
+    
+    // I/O Kit still looks at every registered service of each class to find these, so the pass costs
+    // about as much as a walk of the whole registry and only runs when asked for
+    const struct {
+        const char *className;
+        const char *key;
+        OSObject *value;
+    } queries[] = {
+        {"IOService", "Physical Interconnect Location", external},
+        {"IOMedia", "IOMediaIcon", externalIcon},
+    };
+    
+    for (size_t i = 0; i < sizeof(queries) / sizeof(queries[0]); i++) {
+        auto key = OSSymbol::withCString(queries[i].key);
+        repairMatching[i] = key ? propertyMatching(key, queries[i].value, serviceMatching(queries[i].className)) : nullptr;
+        OSSafeReleaseNULL(key);
+    }
+    
+    external->release();
+    externalIcon->release();
+    return repairMatching[0] && repairMatching[1];
+}
+
+void Innie::repairExternal() {
+    for (auto matching : repairMatching) {
+        auto iterator = getMatchingServices(matching);
+        if (!iterator)
+            continue;
+        countAllocation(allocation::Iterators);
+        
+        while (auto service = OSDynamicCast(IOService, iterator->getNextObject())) {
+            repairStats.matches++;
+            
+            auto device = findStorageAncestor(service);
+            if (!device) {
+                DBGLOG("%s is not behind a PCI storage device", service->getName());
+                continue;
+            }
+            
+            if (isPlanned(service)) {
+                // A dry run leaves External in place, entries the walk already planned to change were not missed
+            } else if (isInternalized(service)) {
+                DBGLOG("patching missed entry %s", service->getName());
+                updateOtherProperties(service, "RepairMatch");
+                repairStats.patched++;
+                
+                // A republished block storage device keeps External in its protocol characteristics,
+                // which property matching cannot find, so patch the providers up to the device as well
+                for (auto parent = service->getParentEntry(gIOServicePlane); parent && parent != device; parent = parent->getParentEntry(gIOServicePlane))
+                    updateOtherProperties(parent, "RepairProvider");
+            } else if (!isBuiltIn(device)) {
+                DBGLOG("internalizing missed device %s", device->getName());
+                internalizeDevice(device);
+                repairStats.internalized++;
+            }
+            announceReady();
+        }
+        iterator->release();
+    }
+}
+
+IORegistryEntry *Innie::findStorageAncestor(IORegistryEntry *entry) {
+    for (auto parent = entry->getParentEntry(gIOServicePlane); parent; parent = parent->getParentEntry(gIOServicePlane)) {
+        auto code = getClassCode(parent);
+        if (code == classCode::SATADevice || code == classCode::NVMeDevice)
+            return parent;
+    }
+    return nullptr;
+}
+
+bool Innie::isLogicalVolume(IORegistryEntry *entry) {
+    size_t parents = 0;
+    if (auto iterator = entry->getParentIterator(gIOServicePlane)) {
+        countAllocation(allocation::Iterators);
+        while (parents < 2 && iterator->getNextObject())
+            parents++;
+        iterator->release();
+    }
+    return parents > 1;
+}
+
+bool Innie::isInternalized(IORegistryEntry *entry) {
+    // Follow the provider links up to the PCI device, or to every member of a volume spanning several disks
+    for (auto parent = entry; parent; parent = parent->getParentEntry(gIOServicePlane)) {
+        if (isLogicalVolume(parent))
+            return allMembersInternalized(parent);
+        
+        auto code = getClassCode(parent);
+        if (code == classCode::SATADevice || code == classCode::NVMeDevice)
+            return isBuiltIn(parent);
+    }
+    return false;
+}
+
+bool Innie::isBuiltIn(IORegistryEntry *device) {
+    // In a dry run, devices the plan sets built-in on count as if it had been set
+    return device->getProperty("built-in") || isPlanned(device);
+}
+
+bool Innie::isPlanned(IORegistryEntry *entry) {
+    if (!plannedEntries)
+        return false;
+    
+    IOLockLock(patchLock);
+    bool planned = plannedEntries->containsObject(entry);
+    IOLockUnlock(patchLock);
+    return planned;
+}
+
+bool Innie::allMembersInternalized(IORegistryEntry *volume) {
+    bool internalized = false;
+    if (auto iterator = volume->getParentIterator(gIOServicePlane)) {
+        countAllocation(allocation::Iterators);
+        internalized = true;
+        while (auto member = OSDynamicCast(IORegistryEntry, iterator->getNextObject())) {
+            if (!isInternalized(member)) {
+                internalized = false;
+                break;
+            }
+        }
+        iterator->release();
+    }
+    return internalized;
+}
+
+void Innie::patchVolume(IORegistryEntry *volume) {
+    // Benchmark runs walk a volume again once it is complete, without marking it
+    if (inBenchmark()) {
+        if (allMembersInternalized(volume)) {
+            updateOtherProperties(volume, "AllMembersInternal");
+            patchDescendants(volume);
+        }
+        return;
+    }
+    
+    // Members are checked outside the lock, the walk of the last one to become internal still finds them all
+    bool complete = allMembersInternalized(volume);
+    
+    IOLockLock(patchLock);
+    if (processedEntries->containsObject(volume)) {
+        IOLockUnlock(patchLock);
+        return;
+    }
+    
+    // Wait for the walk of the last member to reach the volume again
+    if (!complete) {
+        DBGLOG("volume %s has members that are not internal yet", volume->getName());
+        if (!pendingVolumes->containsObject(volume)) {
+            pendingVolumes->setObject(volume);
+            trackObjects(1);
+        }
+        IOLockUnlock(patchLock);
+        return;
+    }
+    
+    DBGLOG("patching volume %s", volume->getName());
+    if (pendingVolumes->containsObject(volume)) {
+        pendingVolumes->removeObject(volume);
+        trackObjects(-1);
+    }
+    processedEntries->setObject(volume);
+    trackObjects(1);
+    patchedVolumes++;
+    IOLockUnlock(patchLock);
+    
+    updateOtherProperties(volume, "AllMembersInternal");
+    patchDescendants(volume);
+}
+
 void Innie::internalizeDevice(IORegistryEntry *entry) {
     DBGLOG("adding built-in property");
+    if (!inBenchmark()) {
+        INNIE_TRACE(traceCode::DeviceInternalized, DBG_FUNC_NONE, entry->getRegistryEntryID(), getClassCode(entry));
+        IOLockLock(patchLock);
+        internalizedDevices++;
+        IOLockUnlock(patchLock);
+    }
     
     setBuiltIn(entry);
     
@@ -121,61 +1219,617 @@ void Innie::internalizeDevice(IORegistryEntry *entry) {
         return;
     
     // Otherwise update existing properties
-    if (auto driverIterator = IORegistryIterator::iterateOver(entry, gIOServicePlane, kIORegistryIterateRecursively)) {
+    patchDescendants(entry);
+}
+
+void Innie::markReady(IORegistryEntry *device) {
+    auto service = OSDynamicCast(IOService, device);
+    if (!service || dryRun || inBenchmark())
+        return;
+    
+    // Agents waiting for one drive can check the marker and listen for the message instead of waiting for registerService()
+    uint64_t elapsed = 0;
+    absolutetime_to_nanoseconds(mach_absolute_time() - startTime, &elapsed);
+    IOLockLock(patchLock);
+    if (!device->getProperty("InnieInternalized")) {
+        device->setProperty("InnieInternalized", true);
+        if (readiness.drives < maxReadySamples)
+            readiness.time[readiness.drives] = elapsed;
+        readiness.drives++;
+        
+        // Clients are called synchronously, so they are only messaged by announceReady() once patchLock is dropped
+        INNIE_TRACE(traceCode::DriveReady, DBG_FUNC_NONE, device->getRegistryEntryID(), elapsed);
+        if (readyDevices->setObject(service))
+            trackObjects(1);
+    }
+    IOLockUnlock(patchLock);
+}
+
+void Innie::announceReady() {
+    IOLockLock(patchLock);
+    OSArray *batch = nullptr;
+    if (readyDevices->getCount() > 0) {
+        batch = OSArray::withArray(readyDevices);
+        if (batch) {
+            trackObjects(-static_cast<int64_t>(readyDevices->getCount()));
+            readyDevices->flushCollection();
+        }
+    }
+    IOLockUnlock(patchLock);
+    
+    if (!batch)
+        return;
+    
+    for (size_t i = 0; i < batch->getCount(); i++) {
+        auto service = OSDynamicCast(IOService, batch->getObject(i));
+        if (service && !service->isInactive())
+            service->messageClients(readyMessage);
+    }
+    batch->release();
+}
+
+void Innie::patchDescendants(IORegistryEntry *entry) {
+    if (auto iterator = entry->getChildIterator(gIOServicePlane)) {
         IORegistryEntry *driverEntry = nullptr;
-        while ((driverEntry = OSDynamicCast(IORegistryEntry, driverIterator->getNextObject())) != nullptr) {
+        countAllocation(allocation::Iterators);
+        while ((driverEntry = OSDynamicCast(IORegistryEntry, iterator->getNextObject())) != nullptr) {
+            OSIncrementAtomic64(&visitedEntries);
+            
+            // Every namespace of a controller is its own block storage device, patched and tracked on its own
+            if (driverEntry->metaCast("IOBlockStorageDevice")) {
+                patchUnit(driverEntry);
+                continue;
+            }
+            
+            // RAID sets, Fusion and APFS containers have one provider per member disk
+            if (isLogicalVolume(driverEntry)) {
+                patchVolume(driverEntry);
+                continue;
+            }
+            
             DBGLOG("updating other properties");
-            updateOtherProperties(driverEntry);
+            updateOtherProperties(driverEntry, "BelowInternalDevice");
+            patchDescendants(driverEntry);
         }
-        driverIterator->release();
+        iterator->release();
     }
 }
 
+bool Innie::patchUnit(IORegistryEntry *unit) {
+    if (inBenchmark()) {
+        updateOtherProperties(unit, "StorageUnit");
+        patchDescendants(unit);
+        return false;
+    }
+    
+    // Claim the unit under the lock, the walk and the notifications may reach it at the same time
+    IOLockLock(patchLock);
+    bool claimed = !processedEntries->containsObject(unit);
+    if (claimed) {
+        processedEntries->setObject(unit);
+        trackObjects(1);
+        patchedUnits++;
+    }
+    IOLockUnlock(patchLock);
+    if (!claimed)
+        return false;
+    
+    DBGLOG("patching unit %s", unit->getName());
+    updateOtherProperties(unit, "StorageUnit");
+    patchDescendants(unit);
+    
+    // The drive is ready once a unit has media and they are patched, media published later get here on their own
+    if (unit->metaCast("IOMedia") || hasMedia(unit)) {
+        if (auto device = findStorageAncestor(unit))
+            markReady(device);
+    }
+    return true;
+}
+
+bool Innie::hasMedia(IORegistryEntry *unit) {
+    bool found = false;
+    if (auto iterator = IORegistryIterator::iterateOver(unit, gIOServicePlane, kIORegistryIterateRecursively)) {
+        countAllocation(allocation::Iterators);
+        while (auto entry = iterator->getNextObject()) {
+            if (entry->metaCast("IOMedia")) {
+                found = true;
+                break;
+            }
+        }
+        iterator->release();
+    }
+    return found;
+}
+
 void Innie::setBuiltIn(IORegistryEntry *entry) {
     if (entry) {
-        char dummy = '\0';
-        entry->setProperty("built-in", &dummy, 1);
+        PropertyUpdate update;
+        update.builtIn = true;
+        collectOtherProperties(entry, update);
+        applyProperties(entry, update, "StorageClassCode");
     }
 }
 
-void Innie::updateOtherProperties(IORegistryEntry *entry) {
+void Innie::updateOtherProperties(IORegistryEntry *entry, const char *reason) {
     if (entry) {
-        OSString *internal = OSString::withCString("Internal");
-        OSString *internalIcon = OSString::withCString("Internal.icns");
-        
-        // Update icon
-        if (auto icon = entry->getProperty("IOMediaIcon")) {
-            if (auto dict = OSDynamicCast(OSDictionary, icon)) {
-                dict = OSDictionary::withDictionary(dict);
-                if (auto res = dict->getObject("IOBundleResourceFile")) {
-                    dict->setObject("IOBundleResourceFile", internalIcon);
-                    entry->setProperty("IOMediaIcon", dict);
+        PropertyUpdate update;
+        collectOtherProperties(entry, update);
+        applyProperties(entry, update, reason);
+    }
+}
+
+void Innie::collectOtherProperties(IORegistryEntry *entry, PropertyUpdate &update) {
+    // Update icon
+    if (auto icon = entry->getProperty("IOMediaIcon")) {
+        if (auto dict = OSDynamicCast(OSDictionary, icon)) {
+            auto file = OSDynamicCast(OSString, dict->getObject("IOBundleResourceFile"));
+            if (file && !file->isEqualTo("Internal.icns")) {
+                update.icon = OSDictionary::withDictionary(dict);
+                if (update.icon) {
+                    countAllocation(allocation::Dictionaries);
+                    update.icon->setObject("IOBundleResourceFile", internalIcon);
                 }
-                dict->release();
             }
         }
-        
-        // Update interconnect
-        if (auto loc = entry->getProperty("Physical Interconnect Location")) {
-            if (auto prop = OSDynamicCast(OSString, loc)) {
-                entry->setProperty("Physical Interconnect Location", internal);
+    }
+    
+    // Update interconnect
+    if (auto loc = entry->getProperty("Physical Interconnect Location")) {
+        auto prop = OSDynamicCast(OSString, loc);
+        if (prop && !prop->isEqualTo("Internal")) {
+            internal->retain();
+            update.location = internal;
+        }
+    }
+    
+    // Update update protocol characteristics
+    if (auto proto = entry->getProperty("Protocol Characteristics")) {
+        if (auto dict = OSDynamicCast(OSDictionary, proto)) {
+            auto prop = OSDynamicCast(OSString, dict->getObject("Physical Interconnect Location"));
+            if (prop && !prop->isEqualTo("Internal")) {
+                update.protocol = OSDictionary::withDictionary(dict);
+                if (update.protocol) {
+                    countAllocation(allocation::Dictionaries);
+                    update.protocol->setObject("Physical Interconnect Location", internal);
+                }
             }
         }
+    }
+}
+
+void Innie::applyProperties(IORegistryEntry *entry, PropertyUpdate &update, const char *reason) {
+    if (inBenchmark()) {
+        // Collecting the update is the work being measured, nothing is applied or planned
+    } else if (dryRun) {
+        addToPlan(entry, update, reason);
+    } else if (update.builtIn || update.icon || update.location || update.protocol) {
+        // Publish every change under a single acquisition of the entry's property lock
+        entry->runPropertyAction(&Innie::applyPropertiesAction, entry, &update);
+        INNIE_TRACE(traceCode::PatchApplied, DBG_FUNC_NONE, entry->getRegistryEntryID(), getChanges(update));
         
-        // Update update protocol characteristics
-        if (auto proto = entry->getProperty("Protocol Characteristics")) {
-            if (auto dict = OSDynamicCast(OSDictionary, proto)) {
-                dict = OSDictionary::withDictionary(dict);
-                if (auto loc = dict->getObject("Physical Interconnect Location")) {
-                    if (auto prop = OSDynamicCast(OSString, loc)) {
-                        dict->setObject("Physical Interconnect Location", internal);
-                        entry->setProperty("Protocol Characteristics", dict);
-                    }
-                }
-                dict->release();
+        if (entry->metaCast("IOMedia"))
+            queueRefresh(OSDynamicCast(IOService, entry));
+    }
+    
+    OSSafeReleaseNULL(update.icon);
+    OSSafeReleaseNULL(update.location);
+    OSSafeReleaseNULL(update.protocol);
+}
+
+uint32_t Innie::getChanges(PropertyUpdate &update) {
+    uint32_t changes = 0;
+    if (update.builtIn)
+        changes |= planChange::BuiltIn;
+    if (update.icon)
+        changes |= planChange::MediaIcon;
+    if (update.location)
+        changes |= planChange::InterconnectLocation;
+    if (update.protocol)
+        changes |= planChange::ProtocolCharacteristics;
+    return changes;
+}
+
+void Innie::addToPlan(IORegistryEntry *entry, PropertyUpdate &update, const char *reason) {
+    // A real run finds nothing left to change on an entry it already patched
+    auto changes = getChanges(update);
+    if (!changes)
+        return;
+    
+    IOLockLock(patchLock);
+    if (plannedEntries->containsObject(entry)) {
+        IOLockUnlock(patchLock);
+        return;
+    }
+    plannedEntries->setObject(entry);
+    trackObjects(1);
+    
+    if (auto step = OSDictionary::withCapacity(4)) {
+        countAllocation(allocation::Dictionaries);
+        if (auto name = OSString::withCString(entry->getName())) {
+            countAllocation(allocation::Strings);
+            step->setObject("Name", name);
+            name->release();
+        }
+        if (auto why = OSString::withCString(reason)) {
+            countAllocation(allocation::Strings);
+            step->setObject("Reason", why);
+            why->release();
+        }
+        setNumber(step, "RegistryID", entry->getRegistryEntryID());
+        setNumber(step, "Changes", changes);
+        plan->setObject(step);
+        trackObjects(1);
+        step->release();
+    }
+    IOLockUnlock(patchLock);
+}
+
+void Innie::publishPlan() {
+    auto published = OSDictionary::withCapacity(2);
+    auto phases = OSDictionary::withCapacity(phase::Count);
+    
+    IOLockLock(patchLock);
+    auto steps = OSArray::withArray(plan);
+    IOLockUnlock(patchLock);
+    
+    if (published && phases && steps) {
+        for (size_t i = 0; i < phase::Count; i++)
+            setNumber(phases, phaseNames[i], phaseTime[i]);
+        published->setObject("PhaseTime", phases);
+        published->setObject("Steps", steps);
+        setProperty("InniePlan", published);
+    }
+    
+    OSSafeReleaseNULL(published);
+    OSSafeReleaseNULL(phases);
+    OSSafeReleaseNULL(steps);
+}
+
+void Innie::recordPhase(size_t which, uint64_t begin) {
+    absolutetime_to_nanoseconds(mach_absolute_time() - begin, &phaseTime[which]);
+}
+
+IOReturn Innie::applyPropertiesAction(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3) {
+    auto entry = OSDynamicCast(IORegistryEntry, target);
+    auto update = static_cast<PropertyUpdate *>(arg0);
+    if (!entry || !update)
+        return kIOReturnBadArgument;
+    
+    if (update->builtIn) {
+        char dummy = '\0';
+        entry->setProperty("built-in", &dummy, 1);
+    }
+    if (update->icon)
+        entry->setProperty("IOMediaIcon", update->icon);
+    if (update->location)
+        entry->setProperty("Physical Interconnect Location", update->location);
+    if (update->protocol)
+        entry->setProperty("Protocol Characteristics", update->protocol);
+    
+    return kIOReturnSuccess;
+}
+
+void Innie::queueRefresh(IOService *media) {
+    if (!media || !refreshMedia || !refreshCall)
+        return;
+    
+    // Media patched within one window are announced together once the window closes
+    IOLockLock(patchLock);
+    refreshStats.patched++;
+    if (refreshMedia->setObject(media))
+        trackObjects(1);
+    if (!refreshScheduled) {
+        uint64_t deadline = 0;
+        clock_interval_to_deadline(config.refreshWindow, kMillisecondScale, &deadline);
+        refreshScheduled = true;
+        thread_call_enter_delayed(refreshCall, deadline);
+    }
+    IOLockUnlock(patchLock);
+}
+
+void Innie::refreshWorker(thread_call_param_t param0, thread_call_param_t param1) {
+    auto that = static_cast<Innie *>(param0);
+    
+    // Media patched while the batch is taken start the next window
+    IOLockLock(that->patchLock);
+    auto batch = OSArray::withCapacity(that->refreshMedia->getCount());
+    if (batch) {
+        if (auto iterator = OSCollectionIterator::withCollection(that->refreshMedia)) {
+            that->countAllocation(allocation::Iterators);
+            while (auto media = iterator->getNextObject())
+                batch->setObject(media);
+            iterator->release();
+        }
+        that->trackObjects(-static_cast<int64_t>(that->refreshMedia->getCount()));
+        that->refreshMedia->flushCollection();
+    }
+    that->refreshScheduled = false;
+    IOLockUnlock(that->patchLock);
+    
+    if (!batch)
+        return;
+    
+    // Clients such as DiskArbitration re-read the description of media on a property change
+    uint64_t messages = 0;
+    for (size_t i = 0; i < batch->getCount(); i++) {
+        auto media = OSDynamicCast(IOService, batch->getObject(i));
+        if (media && !media->isInactive()) {
+            media->messageClients(kIOMessageServicePropertyChange);
+            messages++;
+        }
+    }
+    batch->release();
+    
+    DBGLOG("refreshed %llu media", messages);
+    
+    IOLockLock(that->patchLock);
+    that->refreshStats.batches++;
+    that->refreshStats.messages += messages;
+    IOLockUnlock(that->patchLock);
+}
+
+void Innie::addStorageNotifications() {
+    const char *classes[] = {"IOBlockStorageDevice", "IOMedia"};
+    size_t index = 0;
+    
+    for (auto className : classes) {
+        if (auto matching = serviceMatching(className)) {
+            storageNotifiers[index++] = addMatchingNotification(gIOPublishNotification, matching, &Innie::storagePublished, this);
+            storageNotifiers[index++] = addMatchingNotification(gIOTerminatedNotification, matching, &Innie::storageTerminated, this);
+            matching->release();
+        }
+    }
+    
+    // Hot-plug bridges are not waited for, their devices are picked up as they arrive,
+    // and the fast path finds every storage device this way
+    if (auto matching = serviceMatching("IOPCIDevice")) {
+        storageNotifiers[index++] = addMatchingNotification(gIOPublishNotification, matching, &Innie::hotPlugPublished, this);
+        matching->release();
+    }
+}
+
+bool Innie::storagePublished(void *target, void *refCon, IOService *newService, IONotifier *notifier) {
+    auto that = static_cast<Innie *>(target);
+    auto begin = mach_absolute_time();
+    
+    // Only revisit services below a device that has already been internalized
+    auto device = findStorageAncestor(newService);
+    if (!device)
+        return true;
+    
+    if (that->isInternalized(newService) && that->patchUnit(newService)) {
+        DBGLOG("patched published %s", newService->getName());
+        
+        // Only the replacement of a patched service that was terminated counts as a rematch
+        uint64_t elapsed = 0;
+        absolutetime_to_nanoseconds(mach_absolute_time() - begin, &elapsed);
+        IOLockLock(that->patchLock);
+        auto index = that->terminatedDevices->getNextIndexOfObject(device, 0);
+        if (index != (unsigned int)-1) {
+            that->terminatedDevices->removeObject(index);
+            that->trackObjects(-1);
+            that->rematchStats.count++;
+            that->rematchStats.time += elapsed;
+            if (elapsed > that->rematchStats.maxTime)
+                that->rematchStats.maxTime = elapsed;
+        }
+        IOLockUnlock(that->patchLock);
+    }
+    that->announceReady();
+    
+    return true;
+}
+
+bool Innie::storageTerminated(void *target, void *refCon, IOService *newService, IONotifier *notifier) {
+    auto that = static_cast<Innie *>(target);
+    
+    // Forget only this service, so that its replacement is patched when it is published
+    IOLockLock(that->patchLock);
+    if (that->processedEntries->containsObject(newService)) {
+        that->processedEntries->removeObject(newService);
+        that->trackObjects(-1);
+        
+        // Once for each service, so that every replacement published later is counted as a rematch
+        if (auto device = findStorageAncestor(newService)) {
+            if (that->terminatedDevices->setObject(device))
+                that->trackObjects(1);
+        }
+    }
+    IOLockUnlock(that->patchLock);
+    
+    return true;
+}
+
+void Innie::recordAccess(AccessStatistics &access, uint64_t begin) {
+    uint64_t elapsed = 0;
+    absolutetime_to_nanoseconds(mach_absolute_time() - begin, &elapsed);
+    
+    OSIncrementAtomic64(&access.count);
+    OSAddAtomic64(static_cast<int64_t>(elapsed), &access.time);
+    
+    uint64_t maxTime;
+    do {
+        maxTime = access.maxTime;
+    } while (elapsed > maxTime && !OSCompareAndSwap64(maxTime, elapsed, &access.maxTime));
+}
+
+void Innie::trackObjects(int64_t delta) {
+    int64_t live = OSAddAtomic64(delta, &memory.liveObjects) + delta;
+    
+    int64_t peak;
+    do {
+        peak = memory.peakObjects;
+    } while (live > peak && !OSCompareAndSwap64(peak, live, reinterpret_cast<volatile uint64_t *>(&memory.peakObjects)));
+}
+
+void Innie::countAllocation(size_t kind, int64_t count) {
+    OSAddAtomic64(count, &memory.allocations[kind]);
+}
+
+void Innie::snapshotAllocations(int64_t *counts) {
+    for (size_t i = 0; i < allocation::Count; i++)
+        counts[i] = memory.allocations[i];
+}
+
+void Innie::recordPass(size_t which, const int64_t *before) {
+    for (size_t i = 0; i < allocation::Count; i++)
+        passAllocations[which][i] = memory.allocations[i] - before[i];
+}
+
+uint64_t Innie::getCollectionSlots() {
+    // Slots allocated for references, not the memory of the collections themselves
+    OSCollection *collections[] = {pendingDevices, processedRoots, lateRoots, deferredBridges, processedEntries, pendingVolumes, terminatedDevices, refreshMedia, readyDevices, plan, plannedEntries};
+    uint64_t slots = 0;
+    
+    for (auto collection : collections) {
+        if (collection)
+            slots += collection->getCapacity();
+    }
+    for (size_t i = 0; i < config.workers; i++) {
+        if (walkQueues[i])
+            slots += walkQueues[i]->getCapacity();
+    }
+    
+    return slots;
+}
+
+void Innie::publishStatistics() {
+    auto stats = OSDictionary::withCapacity(1);
+    if (!stats)
+        return;
+    
+    if (auto mode = OSString::withCString(modeNames[config.mode])) {
+        stats->setObject("Mode", mode);
+        mode->release();
+    }
+    
+    // Objects Innie keeps references to, and the objects it created during the passes
+    if (auto footprint = OSDictionary::withCapacity(11)) {
+        setNumber(footprint, "LiveObjects", memory.liveObjects);
+        setNumber(footprint, "PeakObjects", memory.peakObjects);
+        IOLockLock(walkLock);
+        IOLockLock(patchLock);
+        setNumber(footprint, "CollectionSlots", getCollectionSlots());
+        IOLockUnlock(patchLock);
+        IOLockUnlock(walkLock);
+        IOLockLock(passLock);
+        
+        // Objects created by the last pass of each kind, zero for kinds that did not run
+        if (auto passes = OSDictionary::withCapacity(pass::Count)) {
+            for (size_t p = 0; p < pass::Count; p++) {
+                auto created = OSDictionary::withCapacity(allocation::Count);
+                if (!created)
+                    continue;
+                setNumber(created, "Iterators", passAllocations[p][allocation::Iterators]);
+                setNumber(created, "Dictionaries", passAllocations[p][allocation::Dictionaries]);
+                setNumber(created, "Strings", passAllocations[p][allocation::Strings]);
+                passes->setObject(passNames[p], created);
+                created->release();
             }
+            footprint->setObject("Passes", passes);
+            passes->release();
         }
-        internal->release();
-        internalIcon->release();
+        IOLockUnlock(passLock);
+        stats->setObject("Memory", footprint);
+        footprint->release();
+    }
+    
+    if (auto repair = OSDictionary::withCapacity(3)) {
+        setNumber(repair, "Matches", repairStats.matches);
+        setNumber(repair, "Patched", repairStats.patched);
+        setNumber(repair, "Internalized", repairStats.internalized);
+        stats->setObject("Repair", repair);
+        repair->release();
+    }
+    
+    if (auto walk = OSDictionary::withCapacity(6)) {
+        setNumber(walk, "Workers", config.workers);
+        setNumber(walk, "SliceBudget", config.sliceBudget);
+        setNumber(walk, "Timeouts", timeouts);
+        setNumber(walk, "Slices", sliceStats.count);
+        setNumber(walk, "SliceTime", sliceStats.time);
+        setNumber(walk, "MaxSliceTime", sliceStats.maxTime);
+        IOLockLock(walkLock);
+        setNumber(walk, "BridgeWaitTime", bridgeWaitTime);
+        setNumber(walk, "DeferredBridges", deferredBridges->getCount());
+        IOLockUnlock(walkLock);
+        stats->setObject("Walk", walk);
+        walk->release();
+    }
+    
+    IOLockLock(patchLock);
+    if (auto hotPlug = OSDictionary::withCapacity(1)) {
+        setNumber(hotPlug, "Devices", hotPlugDevices);
+        stats->setObject("HotPlug", hotPlug);
+        hotPlug->release();
+    }
+    if (auto ready = OSDictionary::withCapacity(3)) {
+        uint64_t samples[maxReadySamples];
+        size_t count = readiness.drives < maxReadySamples ? readiness.drives : maxReadySamples;
+        memcpy(samples, readiness.time, count * sizeof(samples[0]));
+        setNumber(ready, "Drives", readiness.drives);
+        setNumber(ready, "RegisterService", registerTime);
+        if (count)
+            setSummary(ready, "TimeToReady", samples, count);
+        stats->setObject("Readiness", ready);
+        ready->release();
+    }
+    if (auto boots = OSArray::withCapacity(InnieHistory::maxBoots)) {
+        for (size_t i = 0; i < history.count; i++) {
+            if (auto boot = OSDictionary::withCapacity(4)) {
+                setNumber(boot, "TotalTime", history.boots[i].totalTime);
+                setNumber(boot, "BridgeWaitTime", history.boots[i].bridgeWait);
+                setNumber(boot, "Drives", history.boots[i].drives);
+                setNumber(boot, "Timeouts", history.boots[i].timeouts);
+                boots->setObject(boot);
+                boot->release();
+            }
+        }
+        stats->setObject("History", boots);
+        boots->release();
+    }
+    setNumber(stats, "PatchedUnits", patchedUnits);
+    setNumber(stats, "InternalizedDevices", internalizedDevices);
+    setNumber(stats, "VisitedEntries", visitedEntries);
+    if (auto domains = OSArray::withArray(domainStats)) {
+        stats->setObject("Domains", domains);
+        domains->release();
+    }
+    if (auto phases = OSDictionary::withCapacity(phase::Count)) {
+        for (size_t i = 0; i < phase::Count; i++)
+            setNumber(phases, phaseNames[i], phaseTime[i]);
+        stats->setObject("PhaseTime", phases);
+        phases->release();
+    }
+    if (auto volumes = OSDictionary::withCapacity(2)) {
+        setNumber(volumes, "Patched", patchedVolumes);
+        setNumber(volumes, "Pending", pendingVolumes->getCount());
+        stats->setObject("LogicalVolumes", volumes);
+        volumes->release();
+    }
+    if (auto rematch = OSDictionary::withCapacity(3)) {
+        setNumber(rematch, "Count", rematchStats.count);
+        setNumber(rematch, "TotalTime", rematchStats.time);
+        setNumber(rematch, "MaxTime", rematchStats.maxTime);
+        stats->setObject("Rematch", rematch);
+        rematch->release();
+    }
+    if (auto refresh = OSDictionary::withCapacity(3)) {
+        setNumber(refresh, "PatchedMedia", refreshStats.patched);
+        setNumber(refresh, "Batches", refreshStats.batches);
+        setNumber(refresh, "Messages", refreshStats.messages);
+        stats->setObject("Refresh", refresh);
+        refresh->release();
+    }
+    IOLockUnlock(patchLock);
+    
+    setProperty("InnieStatistics", stats);
+    stats->release();
+}
+
+void Innie::setNumber(OSDictionary *dict, const char *key, uint64_t value) {
+    if (auto number = OSNumber::withNumber(value, 64)) {
+        dict->setObject(key, number);
+        number->release();
     }
 }
@@ -9,6 +9,11 @@
 #define Innie_hpp
 
 #include <IOKit/IOService.h>
+#include <IOKit/IOLocks.h>
+#include <kern/thread_call.h>
+#include <sys/kdebug.h>
+
+#include "InnieHistory.hpp"
 
 class Innie : public IOService {
     OSDeclareDefaultStructors(Innie)
@@ -19,13 +24,140 @@ public:
     virtual IOService *probe(IOService *provider, SInt32 *score) override;
     virtual void stop(IOService *provider) override;
     virtual bool start(IOService *provider) override;
+    virtual IOReturn setProperties(OSObject *properties) override;
     
 private:
+    static constexpr size_t maxWalkWorkers = 16;
+    static constexpr size_t maxWalkDomains = 8;
+    static constexpr size_t maxBenchmarkIterations = 32;
+    static constexpr size_t maxReadySamples = 64;
+    static constexpr uint32_t lateRootTimeout = 1000;
+    
+    // Read once in start() from the personality and boot arguments, never changed afterwards
+    struct Configuration {
+        enum : uint32_t {
+            Off,
+            Synchronous,
+            Asynchronous,
+            FastPath,
+            DryRun,
+        };
+        
+        uint32_t mode {Synchronous};
+        uint32_t rootTimeout {0};
+        uint32_t bridgeTimeout {0};
+#ifdef DEBUG
+        uint32_t logLevel {1};
+#else
+        uint32_t logLevel {0};
+#endif
+        uint32_t workers {4};
+        uint32_t sliceBudget {500};
+        uint32_t refreshWindow {100};
+        uint32_t benchmark {0};
+        uint32_t history {0};
+        uint32_t repair {0};
+    };
+    
+    static Configuration config;
+    
+    // kdebug codes of Innie events, KDBG_CODE(DBG_THIRD_PARTY, traceSubclass, code)
+    static constexpr uint32_t traceSubclass = 0x49;
+    
+    struct traceCode {
+        enum : uint32_t {
+            RootFound          = 1,
+            BridgeWait         = 2,
+            DeviceInternalized = 3,
+            PatchApplied       = 4,
+            DriveReady         = 5,
+        };
+    };
+    
+    // Sent to the clients of a storage device, and to those interested in it, once it is internal
+    static constexpr uint32_t readyMessage = iokit_vendor_specific_msg(0x49);
+    
+    void readConfiguration();
+    uint32_t readNumber(const char *key, const char *bootArg, uint32_t value);
+    void runPasses();
+    static void startWorker(thread_call_param_t param0, thread_call_param_t param1);
+    bool waitForProperty(IORegistryEntry *entry, const char *key, uint32_t timeout);
     void processRoot();
-    void recurseBridge(IORegistryEntry *entry);
+    static bool isHostBridge(IOService *bridge);
+    bool claimHostBridge(IOService *bridge);
+    void queueDomain(IOService *hostBridge, uint32_t timeout);
+    size_t findDomain(IORegistryEntry *bridge);
+    void recordDomains();
+    static bool hostBridgePublished(void *target, void *refCon, IOService *newService, IONotifier *notifier);
+    static bool hostBridgeTerminated(void *target, void *refCon, IOService *newService, IONotifier *notifier);
+    static void rootWorker(thread_call_param_t param0, thread_call_param_t param1);
+    void runBenchmark(uint32_t iterations);
+    static void benchmarkWorker(thread_call_param_t param0, thread_call_param_t param1);
+    bool inBenchmark();
+    bool measuring();
+    void publishBenchmark(uint32_t iterations);
+    static void setSummary(OSDictionary *dict, const char *key, uint64_t *values, size_t count);
+    void recurseBridge(IORegistryEntry *entry, size_t worker, size_t domain);
+    bool allocateWalkPool();
+    void freeWalkPool();
+    void queueBridge(IORegistryEntry *bridge, size_t worker, size_t domain);
+    IORegistryEntry *takeBridge(size_t worker);
+    void queueDevice(IORegistryEntry *device, size_t domain);
+    void drainWalk();
+    static void walkWorker(thread_call_param_t param0, thread_call_param_t param1);
+    void finishBridge(size_t domain);
+    static bool isHotPlugBridge(IORegistryEntry *bridge);
+    bool deferBridge(IORegistryEntry *bridge);
+    static bool hotPlugPublished(void *target, void *refCon, IOService *newService, IONotifier *notifier);
     void internalizeDevice(IORegistryEntry *entry);
+    void markReady(IORegistryEntry *device);
+    void announceReady();
+    void recordHistory();
+    static void historyWorker(thread_call_param_t param0, thread_call_param_t param1);
+    void patchDescendants(IORegistryEntry *entry);
+    bool patchUnit(IORegistryEntry *unit);
+    bool hasMedia(IORegistryEntry *unit);
+    void patchVolume(IORegistryEntry *volume);
+    bool isLogicalVolume(IORegistryEntry *entry);
+    bool isInternalized(IORegistryEntry *entry);
+    bool isBuiltIn(IORegistryEntry *device);
+    bool isPlanned(IORegistryEntry *entry);
+    bool allMembersInternalized(IORegistryEntry *volume);
+    void repairExternal();
+    void addStorageNotifications();
+    void queueRefresh(IOService *media);
+    static void refreshWorker(thread_call_param_t param0, thread_call_param_t param1);
+    static bool storagePublished(void *target, void *refCon, IOService *newService, IONotifier *notifier);
+    static bool storageTerminated(void *target, void *refCon, IOService *newService, IONotifier *notifier);
+    static uint32_t getClassCode(IORegistryEntry *entry);
+    static IORegistryEntry *findStorageAncestor(IORegistryEntry *entry);
     void setBuiltIn(IORegistryEntry *entry);
-    void updateOtherProperties(IORegistryEntry *entry);
+    void updateOtherProperties(IORegistryEntry *entry, const char *reason);
+    
+    // Property changes for one entry, collected first and then applied together
+    struct PropertyUpdate {
+        bool builtIn {false};
+        OSDictionary *icon {nullptr};
+        OSString *location {nullptr};
+        OSDictionary *protocol {nullptr};
+    };
+    
+    void collectOtherProperties(IORegistryEntry *entry, PropertyUpdate &update);
+    void applyProperties(IORegistryEntry *entry, PropertyUpdate &update, const char *reason);
+    static uint32_t getChanges(PropertyUpdate &update);
+    void addToPlan(IORegistryEntry *entry, PropertyUpdate &update, const char *reason);
+    void publishPlan();
+    void recordPhase(size_t which, uint64_t begin);
+    static IOReturn applyPropertiesAction(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3);
+    
+    void publishStatistics();
+    void trackObjects(int64_t delta);
+    void countAllocation(size_t kind, int64_t count = 1);
+    void snapshotAllocations(int64_t *counts);
+    void recordPass(size_t which, const int64_t *before);
+    uint64_t getCollectionSlots();
+    bool createRepairMatching();
+    static void setNumber(OSDictionary *dict, const char *key, uint64_t value);
     
     struct classCode {
         enum : uint32_t {
@@ -34,12 +166,189 @@ private:
             NVMeDevice     = 0x010802,
         };
     };
+    
+    struct AccessStatistics {
+        volatile int64_t count;
+        volatile int64_t time;
+        volatile uint64_t maxTime;
+    };
+    
+    static void recordAccess(AccessStatistics &access, uint64_t begin);
+    
+    struct phase {
+        enum : size_t {
+            Discovery,
+            Walk,
+            Repair,
+            Count
+        };
+    };
+    
+    uint64_t phaseTime[phase::Count] {};
+    
+    // References held in Innie's own collections, and objects created while walking and patching
+    struct allocation {
+        enum : size_t {
+            Iterators,
+            Dictionaries,
+            Strings,
+            Count
+        };
+    };
+    
+    struct {
+        volatile int64_t liveObjects;
+        volatile int64_t peakObjects;
+        volatile int64_t allocations[allocation::Count];
+    } memory {};
+    
+    // Objects created by the last pass of each kind, including the notifications it overlapped, guarded by passLock
+    struct pass {
+        enum : size_t {
+            Boot,
+            LateDomain,
+            Benchmark,
+            Count
+        };
+    };
+    
+    int64_t passAllocations[pass::Count][allocation::Count] {};
+    
+    OSString *internal {nullptr};
+    OSString *internalIcon {nullptr};
+    
+    // Property matching of the repair pass, built once instead of on every pass
+    OSDictionary *repairMatching[2] {};
+    
+    // With -inniedryrun every change is appended to the plan, guarded by patchLock, instead of being applied
+    struct planChange {
+        enum : uint32_t {
+            BuiltIn                 = 1 << 0,
+            MediaIcon               = 1 << 1,
+            InterconnectLocation    = 1 << 2,
+            ProtocolCharacteristics = 1 << 3,
+        };
+    };
+    
+    bool dryRun {false};
+    OSArray *plan {nullptr};
+    OSSet *plannedEntries {nullptr};
+    thread_call_t startCall {nullptr};
+    
+    // Entries found still reporting External after the walk
+    struct {
+        uint64_t matches;
+        uint64_t patched;
+        uint64_t internalized;
+    } repairStats {};
+    
+    // Block storage units and media already patched, guarded by patchLock
+    IOLock *patchLock {nullptr};
+    OSArray *domainStats {nullptr};
+    uint64_t internalizedDevices {0};
+    OSSet *processedEntries {nullptr};
+    uint64_t patchedUnits {0};
+    IONotifier *storageNotifiers[5] {};
+    
+    // Volumes spanning several disks, patched once every member is internal
+    OSSet *pendingVolumes {nullptr};
+    uint64_t patchedVolumes {0};
+    
+    // Storage devices, once for each of their patched services that was terminated, and the
+    // replacements patched after a rematching driver published them again
+    OSArray *terminatedDevices {nullptr};
+    
+    struct {
+        uint64_t count;
+        uint64_t time;
+        uint64_t maxTime;
+    } rematchStats {};
+    
+    // Patched media waiting to be announced to clients, guarded by patchLock
+    OSSet *refreshMedia {nullptr};
+    thread_call_t refreshCall {nullptr};
+    bool refreshScheduled {false};
+    
+    struct {
+        uint64_t patched;
+        uint64_t batches;
+        uint64_t messages;
+    } refreshStats {};
+    
+    // Bridges are walked by a small pool of thread calls, each owning a deque of
+    // pending bridges and stealing from the others when its own runs dry.
+    // Discovered devices are handed back to the thread in start() to be patched.
+    // Workers run at kernel rather than high thread call priority and yield once they have
+    // been running, not counting bridge waits, for the configured slice budget.
+    IOLock *walkLock {nullptr};
+    thread_call_t walkCalls[maxWalkWorkers] {};
+    OSArray *walkQueues[maxWalkWorkers] {};
+    bool walkActive[maxWalkWorkers] {};
+    size_t walkPending {0};
+    OSArray *pendingDevices {nullptr};
+    volatile int64_t bridgeWaitTime {0};
+    volatile int64_t timeouts {0};
+    AccessStatistics sliceStats {};
+    
+    // Domains walked by the pool at the same time, guarded by walkLock. Each one is done, and
+    // its walk time taken, once the last bridge found below its root is finished.
+    struct WalkDomain {
+        IORegistryEntry *root;
+        size_t pending;
+        uint64_t queued;
+        uint64_t finished;
+        uint64_t devices;
+        uint64_t configureWait;
+        bool configured;
+    };
+    
+    WalkDomain walkDomains[maxWalkDomains] {};
+    size_t walkDomainCount {0};
+    
+    // PCI host bridges already walked and those published after the boot pass, guarded by walkLock
+    OSSet *processedRoots {nullptr};
+    OSArray *lateRoots {nullptr};
+    thread_call_t rootCall {nullptr};
+    IONotifier *hostBridgeNotifiers[2] {};
+    
+    // Benchmark runs repeat the whole traversal without changing anything. passLock keeps
+    // them and the walks of late domains apart, the samples are only touched under it.
+    IOLock *passLock {nullptr};
+    thread_call_t benchmarkCall {nullptr};
+    thread_t benchmarkThread {nullptr};
+    volatile int64_t visitedEntries {0};
+    
+    struct {
+        uint64_t time[phase::Count][maxBenchmarkIterations];
+        uint64_t visited[maxBenchmarkIterations];
+    } benchmark {};
+    
+    // Empty hot-plug bridges, guarded by walkLock, and the devices found behind them later
+    OSSet *deferredBridges {nullptr};
+    uint64_t hotPlugDevices {0};
+    
+    // Nanoseconds from start() until each drive was ready and until registerService(), guarded by patchLock
+    uint64_t startTime {0};
+    uint64_t registerTime {0};
+    struct {
+        uint64_t drives;
+        uint64_t time[maxReadySamples];
+    } readiness {};
+    
+    // Drives marked ready whose clients are still to be messaged, guarded by patchLock
+    OSArray *readyDevices {nullptr};
+    
+    // Figures of the last boots, this one included, read from and written back to NVRAM once per boot
+    InnieHistory history {};
+    thread_call_t historyCall {nullptr};
 };
 
-#ifdef DEBUG
-#define DBGLOG(args...) do { IOLog("Innie: " args); } while (0)
-#else
-#define DBGLOG(args...) do { } while (0)
+#ifndef DBG_THIRD_PARTY
+#define DBG_THIRD_PARTY 37
 #endif
 
+// Events are only emitted while a trace is recording them, the arguments are not evaluated otherwise
+#define INNIE_TRACE(code, func, arg1, arg2) do { uint32_t debugid = KDBG_CODE(DBG_THIRD_PARTY, Innie::traceSubclass, code) | (func); if (kdebug_debugid_enabled(debugid)) kernel_debug(debugid, (uintptr_t)(arg1), (uintptr_t)(arg2), 0, 0, 0); } while (0)
+#define DBGLOG(args...) do { if (Innie::config.logLevel) IOLog("Innie: " args); } while (0)
+
 #endif /* Innie */
@@ -0,0 +1,110 @@
+//
+//  InnieHistory.hpp
+//  Innie
+//
+//  Copyright © 2021 cdf. All rights reserved.
+//
+
+#ifndef InnieHistory_hpp
+#define InnieHistory_hpp
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Key figures of the last boots, kept in NVRAM as a small little-endian record:
+// a version byte, a count byte, two reserved bytes and then the boots, oldest first.
+// Free of kernel dependencies so that tools can decode a dump of the variable.
+struct InnieHistory {
+    static constexpr uint8_t version = 1;
+    static constexpr size_t maxBoots = 8;
+    static constexpr size_t headerSize = 4;
+    static constexpr size_t bootSize = 12;
+    static constexpr size_t maxSize = headerSize + maxBoots * bootSize;
+    
+    struct Boot {
+        uint32_t totalTime;
+        uint32_t bridgeWait;
+        uint16_t drives;
+        uint16_t timeouts;
+    };
+    
+    uint8_t count {0};
+    Boot boots[maxBoots] {};
+    
+    // Drops the oldest boots so that no more than capacity remain
+    void append(const Boot &boot, size_t capacity) {
+        if (capacity > maxBoots)
+            capacity = maxBoots;
+        if (capacity == 0)
+            return;
+        
+        while (count >= capacity) {
+            for (size_t i = 1; i < count; i++)
+                boots[i - 1] = boots[i];
+            count--;
+        }
+        boots[count++] = boot;
+    }
+    
+    size_t encode(uint8_t *buffer, size_t size) const {
+        size_t length = headerSize + count * bootSize;
+        if (size < length)
+            return 0;
+        
+        buffer[0] = version;
+        buffer[1] = count;
+        buffer[2] = 0;
+        buffer[3] = 0;
+        auto out = buffer + headerSize;
+        for (size_t i = 0; i < count; i++) {
+            out = put(out, boots[i].totalTime, 4);
+            out = put(out, boots[i].bridgeWait, 4);
+            out = put(out, boots[i].drives, 2);
+            out = put(out, boots[i].timeouts, 2);
+        }
+        return length;
+    }
+    
+    // Leaves the history empty when the record is from another version or truncated
+    bool decode(const uint8_t *buffer, size_t size) {
+        count = 0;
+        if (size < headerSize || buffer[0] != version || buffer[1] > maxBoots || size < headerSize + buffer[1] * bootSize)
+            return false;
+        
+        auto in = buffer + headerSize;
+        for (size_t i = 0; i < buffer[1]; i++) {
+            boots[i].totalTime = static_cast<uint32_t>(get(in, 4));
+            boots[i].bridgeWait = static_cast<uint32_t>(get(in + 4, 4));
+            boots[i].drives = static_cast<uint16_t>(get(in + 8, 2));
+            boots[i].timeouts = static_cast<uint16_t>(get(in + 10, 2));
+            in += bootSize;
+        }
+        count = buffer[1];
+        return true;
+    }
+    
+    // Figures too large for their field are stored as the largest value it holds
+    static uint32_t clamp32(uint64_t value) {
+        return value > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(value);
+    }
+    
+    static uint16_t clamp16(uint64_t value) {
+        return value > UINT16_MAX ? UINT16_MAX : static_cast<uint16_t>(value);
+    }
+    
+private:
+    static uint8_t *put(uint8_t *out, uint32_t value, size_t bytes) {
+        for (size_t i = 0; i < bytes; i++)
+            out[i] = static_cast<uint8_t>(value >> (8 * i));
+        return out + bytes;
+    }
+    
+    static uint32_t get(const uint8_t *in, size_t bytes) {
+        uint32_t value = 0;
+        for (size_t i = 0; i < bytes; i++)
+            value |= static_cast<uint32_t>(in[i]) << (8 * i);
+        return value;
+    }
+};
+
+#endif /* InnieHistory_hpp */
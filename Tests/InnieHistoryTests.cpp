@@ -0,0 +1,138 @@
+//
+//  InnieHistoryTests.cpp
+//  Innie
+//
+//  Copyright © 2021 cdf. All rights reserved.
+//
+//  Host checks of the NVRAM history record, built without the kernel SDK:
+//  c++ -std=c++14 -Wall -Wextra -I Innie Tests/InnieHistoryTests.cpp -o InnieHistoryTests
+//
+
+#include <stdio.h>
+#include <string.h>
+
+#include "InnieHistory.hpp"
+
+static int failures = 0;
+
+#define CHECK(condition) do { if (!(condition)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); failures++; } } while (0)
+
+static InnieHistory::Boot makeBoot(uint32_t n) {
+    return {n * 1000, n * 10, static_cast<uint16_t>(n), static_cast<uint16_t>(n % 3)};
+}
+
+static void testWraparound() {
+    InnieHistory history;
+    for (uint32_t i = 1; i <= InnieHistory::maxBoots + 3; i++)
+        history.append(makeBoot(i), InnieHistory::maxBoots);
+    
+    // The oldest boots are dropped, the rest stay in order
+    CHECK(history.count == InnieHistory::maxBoots);
+    for (size_t i = 0; i < history.count; i++)
+        CHECK(history.boots[i].drives == i + 4);
+    
+    // A capacity above the maximum is clamped
+    history.append(makeBoot(100), InnieHistory::maxBoots + 5);
+    CHECK(history.count == InnieHistory::maxBoots);
+    CHECK(history.boots[history.count - 1].drives == 100);
+}
+
+static void testShrinkingCapacity() {
+    InnieHistory history;
+    for (uint32_t i = 1; i <= 6; i++)
+        history.append(makeBoot(i), 6);
+    
+    // Lowering innie_history drops every boot that no longer fits at the next append
+    history.append(makeBoot(7), 2);
+    CHECK(history.count == 2);
+    CHECK(history.boots[0].drives == 6);
+    CHECK(history.boots[1].drives == 7);
+    
+    // A capacity of zero keeps nothing new
+    history.append(makeBoot(8), 0);
+    CHECK(history.count == 2);
+    CHECK(history.boots[1].drives == 7);
+}
+
+static void testRoundTrip() {
+    InnieHistory history;
+    history.append({0xFFFFFFFF, 0x01020304, 0xFFFF, 7}, 4);
+    history.append(makeBoot(2), 4);
+    
+    uint8_t buffer[InnieHistory::maxSize];
+    auto length = history.encode(buffer, sizeof(buffer));
+    CHECK(length == InnieHistory::headerSize + 2 * InnieHistory::bootSize);
+    CHECK(buffer[0] == InnieHistory::version);
+    CHECK(buffer[1] == 2);
+    
+    // Fields are little-endian whatever the host
+    CHECK(buffer[8] == 0x04 && buffer[9] == 0x03 && buffer[10] == 0x02 && buffer[11] == 0x01);
+    
+    InnieHistory decoded;
+    CHECK(decoded.decode(buffer, length));
+    CHECK(decoded.count == 2);
+    CHECK(memcmp(decoded.boots, history.boots, 2 * sizeof(InnieHistory::Boot)) == 0);
+    
+    // Buffers too small for the record are left alone
+    CHECK(history.encode(buffer, length - 1) == 0);
+}
+
+static void testVersionMismatch() {
+    InnieHistory history;
+    history.append(makeBoot(1), 8);
+    uint8_t buffer[InnieHistory::maxSize];
+    auto length = history.encode(buffer, sizeof(buffer));
+    buffer[0] = InnieHistory::version + 1;
+    
+    // A record from another version is dropped rather than misread
+    InnieHistory decoded;
+    decoded.append(makeBoot(5), 8);
+    CHECK(!decoded.decode(buffer, length));
+    CHECK(decoded.count == 0);
+}
+
+static void testTruncatedInput() {
+    InnieHistory history;
+    for (uint32_t i = 1; i <= 3; i++)
+        history.append(makeBoot(i), 8);
+    uint8_t buffer[InnieHistory::maxSize];
+    auto length = history.encode(buffer, sizeof(buffer));
+    
+    InnieHistory decoded;
+    for (size_t size = 0; size < length; size++) {
+        CHECK(!decoded.decode(buffer, size));
+        CHECK(decoded.count == 0);
+    }
+    
+    // A count above the maximum is rejected even when the buffer is long enough
+    uint8_t large[InnieHistory::headerSize + 9 * InnieHistory::bootSize] {InnieHistory::version, 9};
+    CHECK(!decoded.decode(large, sizeof(large)));
+    CHECK(decoded.count == 0);
+}
+
+static void testSizeBound() {
+    // The NVRAM variable never grows past 100 bytes
+    CHECK(InnieHistory::maxSize == 100);
+    
+    InnieHistory history;
+    for (uint32_t i = 0; i < 3 * InnieHistory::maxBoots; i++)
+        history.append(makeBoot(i), InnieHistory::maxBoots);
+    uint8_t buffer[2 * InnieHistory::maxSize];
+    CHECK(history.encode(buffer, sizeof(buffer)) == InnieHistory::maxSize);
+}
+
+int main() {
+    testWraparound();
+    testShrinkingCapacity();
+    testRoundTrip();
+    testVersionMismatch();
+    testTruncatedInput();
+    testSizeBound();
+    
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}